@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <hiredis/hiredis.h>
+#include "pressure.h"
+
+typedef struct benchState {
+    int work;
+    int next_expected;
+    bool out_of_order;
+} benchState;
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//  Simulates a CPU-heavy handler by hashing the message over and over.
+static unsigned long busy_work(char *buf, int bufsize, int work) {
+    unsigned long hash = 5381;
+    for (int i = 0; i < work; i++) {
+        for (int j = 0; j < bufsize; j++) {
+            hash = hash * 33 + buf[j];
+        }
+    }
+    return hash;
+}
+
+static void *bench_handler(char *buf, int bufsize, void *userdata) {
+    benchState *state = userdata;
+    busy_work(buf, bufsize, state->work);
+
+    int *sequence = malloc(sizeof(int));
+    *sequence = atoi(buf);
+    return sequence;
+}
+
+static void bench_completion(void *result, void *userdata) {
+    benchState *state = userdata;
+    int *sequence = result;
+    if (*sequence != state->next_expected) {
+        state->out_of_order = true;
+    }
+    state->next_expected = *sequence + 1;
+    free(sequence);
+}
+
+static void fill(pressureQueue *queue, int messages) {
+    pressure_delete(queue);
+    pressure_create(queue, 0);
+
+    char line[64];
+    for (int i = 0; i < messages; i++) {
+        //  Pad messages so that each one carries a realistic amount of work.
+        int len = snprintf(line, sizeof(line), "%d", i);
+        memset(line + len + 1, 'x', sizeof(line) - len - 1);
+        pressure_put(queue, line, sizeof(line));
+    }
+    pressure_close(queue);
+}
+
+//  Drains a freshly filled queue without doing any work, to measure the
+//  per-message cost of the queue itself.
+static double drain_rate(pressureQueue *queue, int messages, bool reliable) {
+    fill(queue, messages);
+
+    double start = now();
+    char *buf = NULL;
+    int size;
+    while (kPressureStatus_Success == (reliable ? pressure_get_reliable(queue, &buf, &size)
+                                                : pressure_get(queue, &buf, &size))) {
+        free(buf);
+        buf = NULL;
+    }
+    if (reliable) {
+        pressure_ack(queue);
+    }
+    return messages / (now() - start);
+}
+
+//  Times pipelined commands, so that only their cost in Redis is measured and
+//  not the round trips a get would spend on them anyway.
+static double pipelined_cost(redisContext *c, int count, const char *format, const char *key, const char *arg) {
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        redisAppendCommand(c, format, key, arg);
+    }
+    for (int i = 0; i < count; i++) {
+        redisReply *reply;
+        redisGetReply(c, (void **) &reply);
+        freeReplyObject(reply);
+    }
+    return (now() - start) / count;
+}
+
+//  Per-message cost of popping from a full list, optionally moving each
+//  message into an in-flight list as pressure_get_reliable does.
+static double pop_cost(redisContext *c, int messages, bool inflight) {
+    const char *list = "__pressure__:__bench__:raw";
+    const char *target = "__pressure__:__bench__:raw_inflight";
+    char line[64] = { 0 };
+    for (int i = 0; i < messages; i++) {
+        redisAppendCommand(c, "LPUSH %s %b", list, line, sizeof(line));
+    }
+    for (int i = 0; i < messages; i++) {
+        redisReply *reply;
+        redisGetReply(c, (void **) &reply);
+        freeReplyObject(reply);
+    }
+
+    double cost = inflight ? pipelined_cost(c, messages, "RPOPLPUSH %s %s", list, target)
+                           : pipelined_cost(c, messages, "RPOP %s", list, NULL);
+    freeReplyObject(redisCommand(c, "DEL %s %s", list, target));
+    return cost;
+}
+
+int main(int argc, char **argv) {
+    redisContext *c;
+    const char *hostname = "127.0.0.1";
+    int port = 6379;
+
+    int messages = argc > 1 ? atoi(argv[1]) : 10000;
+    int work = argc > 2 ? atoi(argv[2]) : 2000;
+    int max_threads = argc > 3 ? atoi(argv[3]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (messages <= 0 || work < 0 || max_threads <= 0) {
+        printf("usage: %s [messages] [work_per_message] [max_threads]\n", argv[0]);
+        exit(0);
+    }
+
+    struct timeval timeout = { 1, 500000 }; // 1.5 seconds
+    c = redisConnectWithTimeout(hostname, port, timeout);
+    if (c == NULL || c->err) {
+        if (c) {
+            printf("Connection error: %s\n", c->errstr);
+            redisFree(c);
+        } else {
+            printf("Connection error: can't allocate redis context\n");
+        }
+        exit(1);
+    }
+
+    pressureQueue *queue = pressure_connect(c, "__pressure__", "__bench__");
+
+    printf("%d messages, work %d per message\n", messages, work);
+    printf("%-12s %8s %12s %8s\n", "consumer", "threads", "messages/s", "speedup");
+
+    //  Baseline: a serial consumer built on pressure_get.
+    double serial_rate;
+    {
+        fill(queue, messages);
+
+        double start = now();
+        char *buf = NULL;
+        int size;
+        while (kPressureStatus_Success == pressure_get(queue, &buf, &size)) {
+            busy_work(buf, size, work);
+            free(buf);
+            buf = NULL;
+        }
+        serial_rate = messages / (now() - start);
+        printf("%-12s %8d %12.0f %8.2f\n", "get", 1, serial_rate, 1.0);
+    }
+
+    for (int nthreads = 1; ; nthreads = nthreads * 2 < max_threads ? nthreads * 2 : max_threads) {
+        fill(queue, messages);
+
+        benchState state = { .work = work, .next_expected = 0, .out_of_order = false };
+        double start = now();
+        pressure_consume(queue, bench_handler, nthreads, bench_completion, &state);
+        double rate = messages / (now() - start);
+
+        printf("%-12s %8d %12.0f %8.2f%s\n", "consume", nthreads, rate, rate / serial_rate,
+               state.out_of_order || state.next_expected != messages ? "  (OUT OF ORDER)" : "");
+
+        if (nthreads == max_threads) {
+            break;
+        }
+    }
+
+    //  Cost of reliable consumption. pressure_get and pressure_get_reliable
+    //  pipeline differently, so comparing their rates alone mostly measures
+    //  round trips; instead, time the commands reliability adds and compare
+    //  them with the time a reliable get takes per message.
+    {
+        double plain_rate = drain_rate(queue, messages, false);
+        double reliable_rate = drain_rate(queue, messages, true);
+
+        double pop = pop_cost(c, messages, false);
+        double inflight = pop_cost(c, messages, true) - pop;
+        double heartbeat = pipelined_cost(c, messages, "SET %s 0 EX 10", queue->keys.heartbeat, NULL)
+                         + pipelined_cost(c, messages, "SADD %s %s", queue->keys.consumers, queue->consumer_id);
+        char trim_end[16], ack_label[32];
+        snprintf(trim_end, sizeof(trim_end), "%d", -queue->ack_batch - 1);
+        snprintf(ack_label, sizeof(ack_label), "acks (batch of %d)", queue->ack_batch);
+        double ack = pipelined_cost(c, messages, "LTRIM %s 0 %s", queue->keys.inflight, trim_end) / queue->ack_batch;
+        double per_message = 1 / reliable_rate;
+
+        printf("\n%-12s %12s %8s\n", "consumer", "messages/s", "us/msg");
+        printf("%-12s %12.0f %8.1f\n", "get", plain_rate, 1e6 / plain_rate);
+        printf("%-12s %12.0f %8.1f\n", "get_reliable", reliable_rate, 1e6 * per_message);
+
+        printf("\n%-28s %8s %8s\n", "cost of reliability", "us/msg", "share");
+        printf("%-28s %8.2f %7.1f%%\n", "in-flight list", 1e6 * inflight, 100 * inflight / per_message);
+        printf("%-28s %8.2f %7.1f%%\n", "heartbeat and registration", 1e6 * heartbeat, 100 * heartbeat / per_message);
+        printf("%-28s %8.2f %7.1f%%\n", ack_label, 1e6 * ack, 100 * ack / per_message);
+        printf("%-28s %8.2f %7.1f%%\n", "total", 1e6 * (inflight + heartbeat + ack),
+               100 * (inflight + heartbeat + ack) / per_message);
+        freeReplyObject(redisCommand(c, "DEL %s %s %s", queue->keys.heartbeat, queue->keys.consumers,
+                                     queue->keys.inflight));
+    }
+
+    pressure_delete(queue);
+    pressure_disconnect(queue);
+    redisFree(c);
+
+    return 0;
+}
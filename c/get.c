@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <hiredis/hiredis.h>
 #include "pressure.h"
@@ -12,8 +13,26 @@ int main(int argc, char **argv) {
     const char *hostname = "127.0.0.1";
     int port = 6379;
 
-    if (argc <= 1) {
-        printf("usage: %s <queue_name>\n", argv[0]);
+    char *consumer_id = NULL;
+    int crash_after = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:k:")) != -1) {
+        switch (opt) {
+            case 'r':
+                consumer_id = optarg;
+                break;
+            case 'k':
+                crash_after = atoi(optarg);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        printf("usage: %s [-r consumer_id] [-k crash_after] <queue_name>\n", argv[0]);
         exit(0);
     }
 
@@ -29,7 +48,7 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    pressureQueue *queue = pressure_connect(c, "__pressure__", argv[1]);
+    pressureQueue *queue = pressure_connect(c, "__pressure__", argv[optind]);
 
     switch (pressure_create(queue, 5)) {
         case kPressureStatus_QueueAlreadyExistsError:
@@ -43,17 +62,60 @@ int main(int argc, char **argv) {
     }
 
     char *line = NULL;
-    int bytes_read = 0;
-    bool stop = false;
     int size;
+    int received = 0;
+
+    if (consumer_id == NULL) {
+        while (kPressureStatus_Success == pressure_get(queue, &line, &size)) {
+            //  Simulate a crash, losing the message just received.
+            if (++received == crash_after) {
+                _exit(1);
+            }
+
+            //  Add the trailing null byte, as pressure returns non-null-terminated strings.
+            line = realloc(line, size + 1);
+            line[size] = 0;
+            puts(line);
+            free(line);
+            line = NULL;
+        }
+    } else {
+        if (pressure_set_consumer_id(queue, consumer_id) != kPressureStatus_Success) {
+            printf("Could not set consumer id!\n");
+            exit(1);
+        }
+
+        //  Hold lines back until they can be acknowledged, so that a crash
+        //  never prints a message that will be redelivered.
+        char **lines = calloc(queue->ack_batch, sizeof(char *));
+        int buffered = 0;
+        bool done = false;
+
+        while (!done) {
+            done = kPressureStatus_Success != pressure_get_reliable(queue, &line, &size);
+            if (!done) {
+                if (++received == crash_after) {
+                    _exit(1);
+                }
+
+                line = realloc(line, size + 1);
+                line[size] = 0;
+                lines[buffered++] = line;
+                line = NULL;
+            }
+
+            if (buffered == queue->ack_batch || (done && buffered > 0)) {
+                for (int i = 0; i < buffered; i++) {
+                    puts(lines[i]);
+                    free(lines[i]);
+                }
+                fflush(stdout);
+                buffered = 0;
+                pressure_ack(queue);
+            }
+        }
 
-    while (kPressureStatus_Success == pressure_get(queue, &line, &size)) {
-        //  Add the trailing null byte, as pressure returns non-null-terminated strings.
-        line = realloc(line, size + 1);
-        line[size] = 0;
-        puts(line);
-        free(line);
-        line = NULL;
+        free(lines);
     }
 
     pressure_disconnect(queue);
@@ -3,21 +3,100 @@
 #include <string.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <time.h>
 
 #include <hiredis/hiredis.h>
 
 #include "pressure.h"
-
-#define min(a,b) \
-   ({ __typeof__ (a) _a = (a); \
-       __typeof__ (b) _b = (b); \
-     _a < _b ? _a : _b; })
-
-#ifdef DEBUG
-    #define dbprintf(fmt, ...) printf(fmt, ##__VA_ARGS__)
-#else
-    #define dbprintf(fmt, ...)
-#endif
+#include "pressure_internal.h"
+
+//  Shared payloads (see pressure_put_broadcast_shared) are pushed onto queues as
+//  this prefix followed by the name of the hash that holds the payload. Ordinary
+//  messages that start with a null byte are escaped with another one (see
+//  pressure_escape), so they can never be mistaken for a reference.
+static const char kPressureReferencePrefix[] = "\0__pressure_ref__:";
+static const int kPressureReferencePrefixLength = sizeof(kPressureReferencePrefix) - 1;
+
+//  Atomically reads a shared payload and releases one reference to it.
+static const char *kPressureDereferenceScript =
+    "local data = redis.call('HGET', KEYS[1], 'data') "
+    "if redis.call('HINCRBY', KEYS[1], 'refs', -1) <= 0 then "
+    "  redis.call('DEL', KEYS[1]) "
+    "end "
+    "return data";
+
+//  Releases one reference to each shared payload in KEYS.
+static const char *kPressureReleaseReferencesScript =
+    "for _, key in ipairs(KEYS) do "
+    "  if redis.call('HINCRBY', key, 'refs', -1) <= 0 then "
+    "    redis.call('DEL', key) "
+    "  end "
+    "end "
+    "return #KEYS";
+
+//  Acknowledges the ARGV[1] oldest messages in the in-flight list KEYS[1],
+//  releasing the shared payloads among KEYS[2..] that they reference.
+static const char *kPressureAcknowledgeScript =
+    "local count = tonumber(ARGV[1]) "
+    "local length = tonumber(ARGV[3]) "
+    "local payloads = {} "
+    "for i = 2, #KEYS do "
+    "  payloads[KEYS[i]] = true "
+    "end "
+    "for _, value in ipairs(redis.call('LRANGE', KEYS[1], -count, -1)) do "
+    "  if string.sub(value, 1, length) == ARGV[2] then "
+    "    local key = string.sub(value, length + 1) "
+    "    if payloads[key] and redis.call('HINCRBY', key, 'refs', -1) <= 0 then "
+    "      redis.call('DEL', key) "
+    "    end "
+    "  end "
+    "end "
+    "redis.call('LTRIM', KEYS[1], 0, -count - 1) "
+    "return count";
+
+//  Moves the in-flight list KEYS[3] of consumer ARGV[1] back onto the consuming
+//  end of the queue KEYS[2], oldest message last so that it's popped first, and
+//  unregisters the consumer from KEYS[1]. Nothing happens while its heartbeat
+//  KEYS[4] exists, unless ARGV[2] is 1: the caller is reclaiming its own list,
+//  and stays registered.
+static const char *kPressureRecoverScript =
+    "local own = ARGV[2] == '1' "
+    "if not own and redis.call('EXISTS', KEYS[4]) == 1 then "
+    "  return 0 "
+    "end "
+    "local items = redis.call('LRANGE', KEYS[3], 0, -1) "
+    "for i = 1, #items do "
+    "  redis.call('RPUSH', KEYS[2], items[i]) "
+    "end "
+    "redis.call('DEL', KEYS[3]) "
+    "if not own then "
+    "  redis.call('SREM', KEYS[1], ARGV[1]) "
+    "end "
+    "return #items";
+
+//  Takes the consumer role for reliable consumer ARGV[1], by popping the
+//  consumer_free token KEYS[1] and naming itself in KEYS[2]. Without a token,
+//  the role is taken over from ARGV[2] if it still holds it and has died:
+//  either it's the caller's own id, left by a previous run, or it's a
+//  registered reliable consumer (KEYS[3]) whose heartbeat KEYS[4] expired.
+static const char *kPressureAcquireScript =
+    "if redis.call('RPOP', KEYS[1]) then "
+    "  redis.call('SET', KEYS[2], ARGV[1]) "
+    "  return 1 "
+    "end "
+    "if ARGV[2] == '' or redis.call('GET', KEYS[2]) ~= ARGV[2] then "
+    "  return 0 "
+    "end "
+    "if ARGV[2] == ARGV[1] or (redis.call('SISMEMBER', KEYS[3], ARGV[2]) == 1 "
+    "                          and redis.call('EXISTS', KEYS[4]) == 0) then "
+    "  redis.call('SET', KEYS[2], ARGV[1]) "
+    "  return 2 "
+    "end "
+    "return 0";
+
+//  How often a blocked reliable consumer refreshes its heartbeat, checks
+//  whether the queue has closed and looks for dead consumers.
+static const int kPressureReliablePollSeconds = 1;
 
 char *pressure_key(const char *prefix, const char *name, const char *key) {
     if (key == NULL || key[0] == 0) {
@@ -68,13 +147,32 @@ pressureQueue *pressure_connect(redisContext *context, const char *prefix, const
         return NULL;
     }
 
+    //  Several handles may share a client_uid, but each needs its own in-flight list.
+    static unsigned int handle_counter = 0;
+    char *client_uid = pressure_uid();
+    char *consumer_id = malloc(strlen(client_uid) + 16);
+    sprintf(consumer_id, "%s.%u", client_uid, handle_counter++);
+
+    char *inflight = malloc(strlen(consumer_id) + 16);
+    char *heartbeat = malloc(strlen(consumer_id) + 16);
+    sprintf(inflight, "inflight:%s", consumer_id);
+    sprintf(heartbeat, "heartbeat:%s", consumer_id);
+
     pressureQueue r = {
         .context = context,
         .name = malloc(strlen(name) + 1),
         .exists = false,
         .connected = false,
         .bound = BOUND_NOT_SET,
-        .client_uid = pressure_uid(),
+        .client_uid = client_uid,
+        .consumer_id = consumer_id,
+
+        .ack_batch = DEFAULT_ACK_BATCH,
+        .heartbeat_seconds = DEFAULT_HEARTBEAT_SECONDS,
+        .inflight = 0,
+        .inflight_references = 0,
+        .inflight_payloads = NULL,
+        .recovered_at = 0,
 
         .keys = {
             .queue = pressure_key(prefix, name, NULL),
@@ -94,9 +192,17 @@ pressureQueue *pressure_connect(redisContext *context, const char *prefix, const
 
             .not_full = pressure_key(prefix, name, "not_full"),
             .closed = pressure_key(prefix, name, "closed"),
+            .inflight_count = pressure_key(prefix, name, "inflight_count"),
+
+            .consumers = pressure_key(prefix, name, "consumers"),
+            .inflight = pressure_key(prefix, name, inflight),
+            .heartbeat = pressure_key(prefix, name, heartbeat),
         }
     };
 
+    free(inflight);
+    free(heartbeat);
+
     strncpy(r.name, name, strlen(name) + 1);
     
     //  Make sure the server is available.
@@ -166,6 +272,21 @@ pressureStatus pressure_create(pressureQueue* queue, int bound) {
     }
 }
 
+//  Returns the message as it should be pushed onto a queue: buf itself, or a
+//  newly allocated copy with a null byte prepended if buf starts with one.
+static char *pressure_escape(char *buf, int bufsize, int *length) {
+    if (bufsize == 0 || buf[0] != 0) {
+        *length = bufsize;
+        return buf;
+    }
+
+    char *escaped = malloc(bufsize + 1);
+    escaped[0] = 0;
+    memcpy(escaped + 1, buf, bufsize);
+    *length = bufsize + 1;
+    return escaped;
+}
+
 pressureStatus pressure_put(pressureQueue* queue, char *buf, int bufsize) {
     //  Check if the queue exists.
     {
@@ -209,10 +330,16 @@ pressureStatus pressure_put(pressureQueue* queue, char *buf, int bufsize) {
             }
             {
                 dbprintf("Pushing binary data to queue...\n");
-                redisReply *reply = redisCommand(queue->context, "LPUSH %s %b", queue->keys.queue, buf, bufsize);
-                int queue_length = reply->integer;
-                dbprintf("Done! Queue length is now %d.\n", queue_length);
-                freeReplyObject(reply);
+                int message_length;
+                char *message = pressure_escape(buf, bufsize, &message_length);
+                redisAppendCommand(queue->context, "LPUSH %s %b", queue->keys.queue, message, (size_t) message_length);
+                redisAppendCommand(queue->context, "GET %s", queue->keys.inflight_count);
+                int queue_length = pressure_integer_reply(queue->context);
+                queue_length += pressure_count_reply(queue->context);
+                dbprintf("Done! Queue length (including messages in progress) is now %d.\n", queue_length);
+                if (message != buf) {
+                    free(message);
+                }
 
                 if (queue->bound > 0 && queue_length < queue->bound) {
                     freeReplyObject(redisCommand(queue->context, "LPUSH %s 0", queue->keys.not_full));
@@ -230,6 +357,245 @@ pressureStatus pressure_put(pressureQueue* queue, char *buf, int bufsize) {
     return kPressureStatus_Success;
 }
 
+void pressure_discard_replies(redisContext *context, int count) {
+    for (int i = 0; i < count; i++) {
+        redisReply *reply = NULL;
+        if (redisGetReply(context, (void **) &reply) == REDIS_OK) {
+            freeReplyObject(reply);
+        }
+    }
+}
+
+long long pressure_count_reply(redisContext *context) {
+    redisReply *reply = NULL;
+    long long value = 0;
+    if (redisGetReply(context, (void **) &reply) == REDIS_OK) {
+        if (reply->type == REDIS_REPLY_STRING) {
+            value = atoll(reply->str);
+        }
+        freeReplyObject(reply);
+    }
+    return value;
+}
+
+long long pressure_integer_reply(redisContext *context) {
+    redisReply *reply = NULL;
+    long long value = 0;
+    if (redisGetReply(context, (void **) &reply) == REDIS_OK) {
+        value = reply->integer;
+        freeReplyObject(reply);
+    }
+    return value;
+}
+
+static int pressure_compare_queues(const void *a, const void *b) {
+    return strcmp((*(pressureQueue * const *) a)->keys.queue, (*(pressureQueue * const *) b)->keys.queue);
+}
+
+static pressureStatus pressure_broadcast(pressureQueue **queues, int count, char *buf, int bufsize, bool shared) {
+    if (count <= 0) {
+        return kPressureStatus_Success;
+    }
+
+    //  Every command below is pipelined, so all queues must share one connection.
+    redisContext *context = queues[0]->context;
+    for (int i = 1; i < count; i++) {
+        if (queues[i]->context != context) {
+            return kPressureStatus_UnexpectedFailure;
+        }
+    }
+
+    //  Producer roles are always taken in order of queue name, so that two
+    //  broadcasts to overlapping queues can't each hold a role the other
+    //  is waiting on. A queue listed twice would wait on its own
+    //  producer_free key forever, as the push that releases it is queued
+    //  behind the wait.
+    pressureQueue **sorted = malloc(count * sizeof(pressureQueue *));
+    memcpy(sorted, queues, count * sizeof(pressureQueue *));
+    qsort(sorted, count, sizeof(pressureQueue *), pressure_compare_queues);
+
+    for (int i = 1; i < count; i++) {
+        if (!strcmp(sorted[i - 1]->keys.queue, sorted[i]->keys.queue)) {
+            free(sorted);
+            return kPressureStatus_UnexpectedFailure;
+        }
+    }
+
+    //  Check if the queues exist.
+    for (int i = 0; i < count; i++) {
+        redisAppendCommand(context, "EXISTS %s", sorted[i]->keys.bound);
+    }
+    for (int i = 0; i < count; i++) {
+        sorted[i]->exists = pressure_integer_reply(context);
+    }
+
+    //  Take the producer role on every queue that exists, then check if it's closed.
+    dbprintf("Waiting on producer_free keys...\n");
+    int existing = 0;
+    for (int i = 0; i < count; i++) {
+        if (sorted[i]->exists) {
+            redisAppendCommand(context, "BRPOP %s 0", sorted[i]->keys.producer_free);
+            redisAppendCommand(context, "SET %s %s", sorted[i]->keys.producer, sorted[i]->client_uid);
+            redisAppendCommand(context, "EXISTS %s", sorted[i]->keys.closed);
+            existing++;
+        }
+    }
+    int open = 0;
+    for (int i = 0; i < count; i++) {
+        if (sorted[i]->exists) {
+            pressure_discard_replies(context, 2);
+            sorted[i]->closed = pressure_integer_reply(context);
+            if (!sorted[i]->closed) {
+                open++;
+            }
+        }
+    }
+    dbprintf("Got %d producer_free keys, %d queues open.\n", existing, open);
+
+    //  Store the payload once if requested, and push it (or a reference to it) onto each open queue.
+    int message_length;
+    char *message = pressure_escape(buf, bufsize, &message_length);
+    int pending = 0;
+
+    if (shared && open > 0) {
+        if (message != buf) {
+            free(message);
+        }
+
+        static unsigned int payload_counter = 0;
+        char id[1024];
+        snprintf(id, sizeof(id), "%s:%ld.%u", queues[0]->client_uid, (long) time(NULL), payload_counter++);
+
+        char *payload_key = pressure_key(queues[0]->keys.queue, "payload", id);
+        int payload_key_length = strlen(payload_key);
+
+        message_length = kPressureReferencePrefixLength + payload_key_length;
+        message = malloc(message_length);
+        memcpy(message, kPressureReferencePrefix, kPressureReferencePrefixLength);
+        memcpy(message + kPressureReferencePrefixLength, payload_key, payload_key_length);
+
+        redisAppendCommand(context, "HMSET %s data %b refs %d", payload_key, buf, (size_t) bufsize, open);
+        pending++;
+        free(payload_key);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!sorted[i]->exists) {
+            continue;
+        }
+        if (sorted[i]->closed) {
+            redisAppendCommand(context, "LPUSH %s 0", sorted[i]->keys.producer_free);
+            pending++;
+        } else if (sorted[i]->bound > 0) {
+            redisAppendCommand(context, "BRPOP %s 0", sorted[i]->keys.not_full);
+            pending++;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (sorted[i]->exists && !sorted[i]->closed) {
+            redisAppendCommand(context, "LPUSH %s %b", sorted[i]->keys.queue, message, (size_t) message_length);
+            redisAppendCommand(context, "GET %s", sorted[i]->keys.inflight_count);
+        }
+    }
+
+    dbprintf("Pushing %d bytes of data to %d queues...\n", message_length, open);
+    pressure_discard_replies(context, pending);
+
+    pending = 0;
+    for (int i = 0; i < count; i++) {
+        if (sorted[i]->exists && !sorted[i]->closed) {
+            int queue_length = pressure_integer_reply(context);
+            queue_length += pressure_count_reply(context);
+            if (sorted[i]->bound > 0 && queue_length < sorted[i]->bound) {
+                redisAppendCommand(context, "LPUSH %s 0", sorted[i]->keys.not_full);
+                redisAppendCommand(context, "LTRIM %s 0 0", sorted[i]->keys.not_full);
+                pending += 2;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (sorted[i]->exists && !sorted[i]->closed) {
+            redisAppendCommand(context, "INCR %s", sorted[i]->keys.stats_produced_messages);
+            redisAppendCommand(context, "INCRBY %s %d", sorted[i]->keys.stats_produced_bytes, bufsize);
+            redisAppendCommand(context, "LPUSH %s 0", sorted[i]->keys.producer_free);
+            pending += 3;
+        }
+    }
+    pressure_discard_replies(context, pending);
+    dbprintf("Done!\n");
+
+    if (message != buf) {
+        free(message);
+    }
+    free(sorted);
+
+    for (int i = 0; i < count; i++) {
+        if (!queues[i]->exists) {
+            return kPressureStatus_QueueDoesNotExistError;
+        } else if (queues[i]->closed) {
+            return kPressureStatus_QueueClosed;
+        }
+    }
+    return kPressureStatus_Success;
+}
+
+pressureStatus pressure_put_broadcast(pressureQueue **queues, int count, char *buf, int bufsize) {
+    return pressure_broadcast(queues, count, buf, bufsize, false);
+}
+
+pressureStatus pressure_put_broadcast_shared(pressureQueue **queues, int count, char *buf, int bufsize) {
+    return pressure_broadcast(queues, count, buf, bufsize, true);
+}
+
+int pressure_read_element(pressureQueue *queue, redisReply *element, char **buf, int *bufsize, bool release) {
+    redisReply *payload = NULL;
+    char *data = element->str;
+    int data_length = element->len;
+
+    if (data_length > kPressureReferencePrefixLength
+        && !memcmp(data, kPressureReferencePrefix, kPressureReferencePrefixLength)) {
+        char *payload_key = data + kPressureReferencePrefixLength;
+        size_t payload_key_length = data_length - kPressureReferencePrefixLength;
+        if (release) {
+            payload = redisCommand(queue->context, "EVAL %s 1 %b", kPressureDereferenceScript,
+                                   payload_key, payload_key_length);
+        } else {
+            payload = redisCommand(queue->context, "HGET %b data", payload_key, payload_key_length);
+
+            //  Remember the payload, so that acknowledging the message can release it.
+            char *key = malloc(payload_key_length + 1);
+            memcpy(key, payload_key, payload_key_length);
+            key[payload_key_length] = 0;
+            queue->inflight_payloads = realloc(queue->inflight_payloads,
+                                               (queue->inflight_references + 1) * sizeof(char *));
+            queue->inflight_payloads[queue->inflight_references++] = key;
+        }
+        if (payload->type != REDIS_REPLY_STRING) {
+            freeReplyObject(payload);
+            return -1;
+        }
+        data = payload->str;
+        data_length = payload->len;
+    } else if (data_length > 1 && data[0] == 0 && data[1] == 0) {
+        //  An ordinary message that was escaped by pressure_escape.
+        data++;
+        data_length--;
+    }
+
+    if (*buf == NULL) {
+        *buf = malloc(data_length);
+        *bufsize = data_length;
+    } else {
+        *bufsize = min(*bufsize, data_length);
+    }
+    memcpy(*buf, data, *bufsize);
+
+    if (payload != NULL) {
+        freeReplyObject(payload);
+    }
+    return data_length;
+}
+
 pressureStatus pressure_get(pressureQueue* queue, char **buf, int *bufsize) {
     //  Check if the queue exists.
     {
@@ -250,8 +616,11 @@ pressureStatus pressure_get(pressureQueue* queue, char **buf, int *bufsize) {
     }
 
     {
-        redisReply *reply = redisCommand(queue->context, "SET %s %s", queue->keys.consumer, queue->client_uid);
-        freeReplyObject(reply);
+        //  Only pressure_consume counts messages in inflight_count, and it has
+        //  given up the consumer role, so any count left over is stale.
+        redisAppendCommand(queue->context, "SET %s %s", queue->keys.consumer, queue->client_uid);
+        redisAppendCommand(queue->context, "DEL %s", queue->keys.inflight_count);
+        pressure_discard_replies(queue->context, 2);
         dbprintf("Set consumer tag '%s' to '%s'.\n", queue->keys.consumer, queue->client_uid);
     }
 
@@ -272,17 +641,15 @@ pressureStatus pressure_get(pressureQueue* queue, char **buf, int *bufsize) {
             } else {
                 dbprintf("Waiting on data...\n");
                 redisReply *reply = redisCommand(queue->context, "BRPOP %s 0", queue->keys.queue);
-                int data_length = reply->element[1]->len;
+                int data_length = pressure_read_element(queue, reply->element[1], buf, bufsize, true);
+                freeReplyObject(reply);
 
-                if (*buf == NULL) {
-                    *buf = malloc(data_length);
-                    *bufsize = data_length;
-                } else {
-                    *bufsize = min(*bufsize, data_length);
+                if (data_length < 0) {
+                    freeReplyObject(redisCommand(
+                        queue->context, "LPUSH %s 0", queue->keys.consumer_free
+                    ));
+                    return kPressureStatus_UnexpectedFailure;
                 }
-                memcpy(*buf, reply->element[1]->str, *bufsize);
-
-                freeReplyObject(reply);
                 dbprintf("Got data!\n");
             }
 
@@ -301,18 +668,16 @@ pressureStatus pressure_get(pressureQueue* queue, char **buf, int *bufsize) {
                     ));
                     return kPressureStatus_QueueClosed;
                 } else {
-                    int data_length = reply->element[1]->len;
+                    int data_length = pressure_read_element(queue, reply->element[1], buf, bufsize, true);
+                    freeReplyObject(reply);
 
-                    if (*buf == NULL) {
-                        *buf = malloc(data_length);
-                        *bufsize = data_length;
-                    } else {
-                        *bufsize = min(*bufsize, data_length);
+                    if (data_length < 0) {
+                        freeReplyObject(redisCommand(
+                            queue->context, "LPUSH %s 0", queue->keys.consumer_free
+                        ));
+                        return kPressureStatus_UnexpectedFailure;
                     }
-                    memcpy(*buf, reply->element[1]->str, *bufsize);
-
                     dbprintf("Got %d bytes of data!\n", data_length);
-                    freeReplyObject(reply);
 
                     freeReplyObject(redisCommand(queue->context, "LPUSH %s 0", queue->keys.not_full));
                     freeReplyObject(redisCommand(queue->context, "LTRIM %s 0 0", queue->keys.not_full));
@@ -329,6 +694,323 @@ pressureStatus pressure_get(pressureQueue* queue, char **buf, int *bufsize) {
     return kPressureStatus_Success;
 }
 
+pressureStatus pressure_set_consumer_id(pressureQueue* queue, const char *consumer_id) {
+    if (queue->inflight > 0) {
+        return kPressureStatus_UnexpectedFailure;
+    }
+
+    free(queue->consumer_id);
+    free(queue->keys.inflight);
+    free(queue->keys.heartbeat);
+
+    queue->consumer_id = malloc(strlen(consumer_id) + 1);
+    strcpy(queue->consumer_id, consumer_id);
+    queue->keys.inflight = pressure_key(queue->keys.queue, "inflight", consumer_id);
+    queue->keys.heartbeat = pressure_key(queue->keys.queue, "heartbeat", consumer_id);
+
+    //  Reclaim the previous run's in-flight list on the next reliable get.
+    queue->recovered_at = 0;
+    return kPressureStatus_Success;
+}
+
+static void pressure_forget_references(pressureQueue *queue) {
+    for (int i = 0; i < queue->inflight_references; i++) {
+        free(queue->inflight_payloads[i]);
+    }
+    free(queue->inflight_payloads);
+    queue->inflight_payloads = NULL;
+    queue->inflight_references = 0;
+}
+
+//  Appends one command that acknowledges everything in the in-flight list.
+static void pressure_append_ack(pressureQueue *queue) {
+    if (queue->inflight_references > 0) {
+        //  Every payload the script may release is passed as a key.
+        int argc = 0;
+        const char **argv = malloc((queue->inflight_references + 7) * sizeof(char *));
+        size_t *argvlen = malloc((queue->inflight_references + 7) * sizeof(size_t));
+        char numkeys[16], count[16], prefix_length[16];
+        snprintf(numkeys, sizeof(numkeys), "%d", queue->inflight_references + 1);
+        snprintf(count, sizeof(count), "%d", queue->inflight);
+        snprintf(prefix_length, sizeof(prefix_length), "%d", kPressureReferencePrefixLength);
+
+        argv[argc] = "EVAL"; argvlen[argc++] = 4;
+        argv[argc] = kPressureAcknowledgeScript; argvlen[argc++] = strlen(kPressureAcknowledgeScript);
+        argv[argc] = numkeys; argvlen[argc++] = strlen(numkeys);
+        argv[argc] = queue->keys.inflight; argvlen[argc++] = strlen(queue->keys.inflight);
+        for (int i = 0; i < queue->inflight_references; i++) {
+            argv[argc] = queue->inflight_payloads[i]; argvlen[argc++] = strlen(queue->inflight_payloads[i]);
+        }
+        argv[argc] = count; argvlen[argc++] = strlen(count);
+        argv[argc] = kPressureReferencePrefix; argvlen[argc++] = kPressureReferencePrefixLength;
+        argv[argc] = prefix_length; argvlen[argc++] = strlen(prefix_length);
+
+        redisAppendCommandArgv(queue->context, argc, argv, argvlen);
+        free(argv);
+        free(argvlen);
+    } else {
+        redisAppendCommand(queue->context, "LTRIM %s 0 %d", queue->keys.inflight, -queue->inflight - 1);
+    }
+    queue->inflight = 0;
+    pressure_forget_references(queue);
+}
+
+//  Blocks until this handle holds the consumer role, which it names with its
+//  consumer_id so that others can tell if it dies while holding it. Returns
+//  true if the role was taken over from a dead consumer.
+static bool pressure_acquire_reliable(pressureQueue *queue) {
+    char *holder = NULL;
+    for (;;) {
+        char *holder_heartbeat = pressure_key(queue->keys.queue, "heartbeat", holder ? holder : queue->consumer_id);
+        redisReply *reply = redisCommand(queue->context, "EVAL %s 4 %s %s %s %s %s %s",
+                                         kPressureAcquireScript,
+                                         queue->keys.consumer_free,
+                                         queue->keys.consumer,
+                                         queue->keys.consumers,
+                                         holder_heartbeat,
+                                         queue->consumer_id,
+                                         holder ? holder : "");
+        long long acquired = reply->type == REDIS_REPLY_INTEGER ? reply->integer : 0;
+        freeReplyObject(reply);
+        free(holder_heartbeat);
+        free(holder);
+        holder = NULL;
+
+        if (acquired) {
+            if (acquired == 2) {
+                dbprintf("Took the consumer role over from a dead consumer.\n");
+            }
+            return acquired == 2;
+        }
+
+        //  Wait for the token without taking it, and stay alive meanwhile:
+        //  messages processed since the last acknowledgement are still in the
+        //  in-flight list, and would otherwise be redelivered.
+        redisAppendCommand(queue->context, "SET %s 0 EX %d", queue->keys.heartbeat, queue->heartbeat_seconds);
+        redisAppendCommand(queue->context, "BRPOPLPUSH %s %s %d",
+                           queue->keys.consumer_free, queue->keys.consumer_free, kPressureReliablePollSeconds);
+        redisAppendCommand(queue->context, "GET %s", queue->keys.consumer);
+        pressure_discard_replies(queue->context, 2);
+
+        redisGetReply(queue->context, (void **) &reply);
+        if (reply->type == REDIS_REPLY_STRING) {
+            holder = malloc(reply->len + 1);
+            memcpy(holder, reply->str, reply->len + 1);
+        }
+        freeReplyObject(reply);
+    }
+}
+
+//  Counts the messages in other consumers' in-flight lists, which go back
+//  onto the queue if those consumers die.
+static long long pressure_inflight_elsewhere(pressureQueue *queue) {
+    redisReply *consumers = redisCommand(queue->context, "SMEMBERS %s", queue->keys.consumers);
+    int replies = 0;
+    if (consumers->type == REDIS_REPLY_ARRAY) {
+        for (size_t i = 0; i < consumers->elements; i++) {
+            if (!strcmp(consumers->element[i]->str, queue->consumer_id)) {
+                continue;
+            }
+            char *inflight = pressure_key(queue->keys.queue, "inflight", consumers->element[i]->str);
+            redisAppendCommand(queue->context, "LLEN %s", inflight);
+            free(inflight);
+            replies++;
+        }
+    }
+    freeReplyObject(consumers);
+
+    long long total = 0;
+    for (int i = 0; i < replies; i++) {
+        total += pressure_integer_reply(queue->context);
+    }
+    return total;
+}
+
+pressureStatus pressure_get_reliable(pressureQueue* queue, char **buf, int *bufsize) {
+    //  Check if the queue exists.
+    {
+        redisReply *reply = redisCommand(queue->context, "EXISTS %s", queue->keys.bound);
+        queue->exists = reply->integer;
+        freeReplyObject(reply);
+    }
+
+    if (!queue->exists) {
+        return kPressureStatus_QueueDoesNotExistError;
+    }
+
+    dbprintf("Waiting on a consumer_free key...\n");
+    if (pressure_acquire_reliable(queue)) {
+        //  The previous holder died, possibly with a message it had just popped.
+        queue->recovered_at = 0;
+    }
+    dbprintf("Got a consumer_free key!\n");
+
+    if (time(NULL) - queue->recovered_at >= queue->heartbeat_seconds) {
+        pressure_recover(queue, NULL);
+    }
+
+    //  Everything returned by previous calls has now been processed.
+    {
+        int replies = 3;
+        redisAppendCommand(queue->context, "DEL %s", queue->keys.inflight_count);
+        redisAppendCommand(queue->context, "SET %s 0 EX %d", queue->keys.heartbeat, queue->heartbeat_seconds);
+        //  Register on every call: recovery by another consumer may have
+        //  unregistered this one while it still had messages in flight.
+        redisAppendCommand(queue->context, "SADD %s %s", queue->keys.consumers, queue->consumer_id);
+        if (queue->inflight >= queue->ack_batch) {
+            dbprintf("Acknowledging %d messages.\n", queue->inflight);
+            pressure_append_ack(queue);
+            replies++;
+        }
+        redisAppendCommand(queue->context, "EXISTS %s", queue->keys.closed);
+
+        pressure_discard_replies(queue->context, replies);
+        queue->closed = pressure_integer_reply(queue->context);
+    }
+
+    //  BRPOPLPUSH can only wait on one list, so wake up periodically to check
+    //  if the queue has been closed.
+    redisReply *reply = NULL;
+    while (reply == NULL) {
+        if (queue->closed) {
+            reply = redisCommand(queue->context, "RPOPLPUSH %s %s", queue->keys.queue, queue->keys.inflight);
+            if (reply->type != REDIS_REPLY_STRING) {
+                freeReplyObject(reply);
+                reply = NULL;
+
+                //  Other consumers may be waiting on these to finish too.
+                if (queue->inflight > 0) {
+                    pressure_append_ack(queue);
+                    pressure_discard_replies(queue->context, 1);
+                }
+
+                freeReplyObject(redisCommand(
+                    queue->context, "LPUSH %s 0", queue->keys.consumer_free
+                ));
+                if (pressure_inflight_elsewhere(queue) == 0) {
+                    return kPressureStatus_QueueClosed;
+                }
+
+                //  Messages still in flight elsewhere come back onto the queue
+                //  if their consumer dies. Wait for them without the role, as
+                //  live consumers need it to acknowledge theirs.
+                dbprintf("Waiting on messages in flight elsewhere...\n");
+                sleep(kPressureReliablePollSeconds);
+                pressure_acquire_reliable(queue);
+                pressure_recover(queue, NULL);
+                freeReplyObject(redisCommand(queue->context, "SET %s 0 EX %d",
+                                             queue->keys.heartbeat, queue->heartbeat_seconds));
+            }
+        } else {
+            dbprintf("Pulling binary data from queue...\n");
+            reply = redisCommand(queue->context, "BRPOPLPUSH %s %s %d",
+                                 queue->keys.queue, queue->keys.inflight, kPressureReliablePollSeconds);
+            if (reply->type != REDIS_REPLY_STRING) {
+                freeReplyObject(reply);
+                reply = NULL;
+
+                //  Nothing to consume, so messages may be stuck in a dead
+                //  consumer's in-flight list.
+                pressure_recover(queue, NULL);
+
+                redisAppendCommand(queue->context, "SET %s 0 EX %d", queue->keys.heartbeat, queue->heartbeat_seconds);
+                redisAppendCommand(queue->context, "EXISTS %s", queue->keys.closed);
+                pressure_discard_replies(queue->context, 1);
+                queue->closed = pressure_integer_reply(queue->context);
+            }
+        }
+    }
+
+    queue->inflight++;
+    int data_length = pressure_read_element(queue, reply, buf, bufsize, false);
+    freeReplyObject(reply);
+
+    if (data_length < 0) {
+        freeReplyObject(redisCommand(
+            queue->context, "LPUSH %s 0", queue->keys.consumer_free
+        ));
+        return kPressureStatus_UnexpectedFailure;
+    }
+    dbprintf("Got %d bytes of data!\n", data_length);
+
+    redisAppendCommand(queue->context, "LPUSH %s 0", queue->keys.not_full);
+    redisAppendCommand(queue->context, "LTRIM %s 0 0", queue->keys.not_full);
+    redisAppendCommand(queue->context, "INCR %s", queue->keys.stats_consumed_messages);
+    redisAppendCommand(queue->context, "INCRBY %s %d", queue->keys.stats_consumed_bytes, data_length);
+    redisAppendCommand(queue->context, "LPUSH %s 0", queue->keys.consumer_free);
+    pressure_discard_replies(queue->context, 5);
+
+    return kPressureStatus_Success;
+}
+
+pressureStatus pressure_ack(pressureQueue* queue) {
+    if (queue->inflight > 0) {
+        dbprintf("Acknowledging %d messages.\n", queue->inflight);
+        pressure_append_ack(queue);
+        redisAppendCommand(queue->context, "SET %s 0 EX %d", queue->keys.heartbeat, queue->heartbeat_seconds);
+        pressure_discard_replies(queue->context, 2);
+    }
+    return kPressureStatus_Success;
+}
+
+pressureStatus pressure_recover(pressureQueue* queue, int *recovered) {
+    //  Recover each consumer with its own script, so that every key the script
+    //  touches is declared.
+    redisReply *consumers = redisCommand(queue->context, "SMEMBERS %s", queue->keys.consumers);
+    if (consumers->type != REDIS_REPLY_ARRAY) {
+        freeReplyObject(consumers);
+        return kPressureStatus_UnexpectedFailure;
+    }
+
+    int replies = 0;
+    for (size_t i = 0; i < consumers->elements; i++) {
+        char *id = consumers->element[i]->str;
+
+        //  With nothing in flight, anything in our own list was left there by
+        //  a previous run under the same consumer id.
+        bool own = !strcmp(id, queue->consumer_id);
+        if (own && queue->inflight > 0) {
+            continue;
+        }
+
+        char *inflight = pressure_key(queue->keys.queue, "inflight", id);
+        char *heartbeat = pressure_key(queue->keys.queue, "heartbeat", id);
+        redisAppendCommand(queue->context, "EVAL %s 4 %s %s %s %s %s %d",
+                           kPressureRecoverScript,
+                           queue->keys.consumers,
+                           queue->keys.queue,
+                           inflight,
+                           heartbeat,
+                           id,
+                           own);
+        free(inflight);
+        free(heartbeat);
+        replies++;
+    }
+    freeReplyObject(consumers);
+
+    pressureStatus status = kPressureStatus_Success;
+    long long total = 0;
+    for (int i = 0; i < replies; i++) {
+        redisReply *reply;
+        redisGetReply(queue->context, (void **) &reply);
+        if (reply->type == REDIS_REPLY_INTEGER) {
+            total += reply->integer;
+        } else {
+            status = kPressureStatus_UnexpectedFailure;
+        }
+        freeReplyObject(reply);
+    }
+
+    dbprintf("Recovered %lld in-flight messages.\n", total);
+    if (recovered != NULL) {
+        *recovered = total;
+    }
+
+    queue->recovered_at = time(NULL);
+    return status;
+}
+
 pressureStatus pressure_close(pressureQueue *queue) {
     //  Check if the queue exists.
     {
@@ -375,6 +1057,43 @@ pressureStatus pressure_close(pressureQueue *queue) {
     return kPressureStatus_Success;
 }
 
+//  Releases the shared payloads referenced by every message in a list. The
+//  list is read here rather than by the script, so that the script only
+//  touches keys it's given.
+static void pressure_release_references(pressureQueue *queue, const char *list) {
+    redisReply *reply = redisCommand(queue->context, "LRANGE %s 0 -1", list);
+    if (reply->type != REDIS_REPLY_ARRAY) {
+        freeReplyObject(reply);
+        return;
+    }
+
+    int argc = 0;
+    const char **argv = malloc((reply->elements + 3) * sizeof(char *));
+    size_t *argvlen = malloc((reply->elements + 3) * sizeof(size_t));
+    char numkeys[16];
+    argv[argc] = "EVAL"; argvlen[argc++] = 4;
+    argv[argc] = kPressureReleaseReferencesScript; argvlen[argc++] = strlen(kPressureReleaseReferencesScript);
+    argv[argc] = numkeys; argvlen[argc++] = 0;
+
+    for (size_t i = 0; i < reply->elements; i++) {
+        redisReply *element = reply->element[i];
+        if (element->len > (size_t) kPressureReferencePrefixLength
+            && !memcmp(element->str, kPressureReferencePrefix, kPressureReferencePrefixLength)) {
+            argv[argc] = element->str + kPressureReferencePrefixLength;
+            argvlen[argc++] = element->len - kPressureReferencePrefixLength;
+        }
+    }
+
+    if (argc > 3) {
+        argvlen[2] = snprintf(numkeys, sizeof(numkeys), "%d", argc - 3);
+        freeReplyObject(redisCommandArgv(queue->context, argc, argv, argvlen));
+    }
+
+    free(argv);
+    free(argvlen);
+    freeReplyObject(reply);
+}
+
 pressureStatus pressure_delete(pressureQueue *queue) {
     //  Check if the queue exists.
     redisReply *reply = redisCommand(queue->context, "EXISTS %s", queue->keys.bound);
@@ -395,9 +1114,32 @@ pressureStatus pressure_delete(pressureQueue *queue) {
     freeReplyObject(redisCommand(queue->context, "BRPOP %s 0", queue->keys.consumer_free));
     freeReplyObject(redisCommand(queue->context, "DEL %s %s", queue->keys.consumer, queue->keys.consumer_free));
 
-    freeReplyObject(redisCommand(queue->context, "DEL %s %s %s %s %s %s %s",
+    //  Release any shared payloads that will never be consumed.
+    pressure_release_references(queue, queue->keys.queue);
+
+    //  Drop the in-flight lists of every reliable consumer, live or dead.
+    reply = redisCommand(queue->context, "SMEMBERS %s", queue->keys.consumers);
+    if (reply->type == REDIS_REPLY_ARRAY) {
+        for (size_t i = 0; i < reply->elements; i++) {
+            char *inflight = pressure_key(queue->keys.queue, "inflight", reply->element[i]->str);
+            char *heartbeat = pressure_key(queue->keys.queue, "heartbeat", reply->element[i]->str);
+
+            pressure_release_references(queue, inflight);
+            freeReplyObject(redisCommand(queue->context, "DEL %s %s", inflight, heartbeat));
+
+            free(inflight);
+            free(heartbeat);
+        }
+    }
+    freeReplyObject(reply);
+    freeReplyObject(redisCommand(queue->context, "DEL %s", queue->keys.consumers));
+    queue->inflight = 0;
+    pressure_forget_references(queue);
+
+    freeReplyObject(redisCommand(queue->context, "DEL %s %s %s %s %s %s %s %s",
                                  queue->keys.not_full, 
                                  queue->keys.closed,
+                                 queue->keys.inflight_count,
                                  queue->keys.stats_produced_messages,
                                  queue->keys.stats_produced_bytes,
                                  queue->keys.stats_consumed_messages,
@@ -463,6 +1205,8 @@ void pressure_disconnect(pressureQueue *queue) {
 
         free(queue->name);                        
         free(queue->client_uid);                  
+        free(queue->consumer_id);
+        pressure_forget_references(queue);
 
         free(queue->keys.queue);                  
         free(queue->keys.bound);                  
@@ -478,6 +1222,11 @@ void pressure_disconnect(pressureQueue *queue) {
 
         free(queue->keys.not_full);               
         free(queue->keys.closed);                 
+        free(queue->keys.inflight_count);
+
+        free(queue->keys.consumers);
+        free(queue->keys.inflight);
+        free(queue->keys.heartbeat);
     }
     free(queue);
 }
@@ -492,6 +1241,7 @@ void pressure_print(pressureQueue *queue) {
         dbprintf("\tbound\t%d\n", queue->bound);
     }
     dbprintf("\tclient_uid:\t%s\n", queue->client_uid);
+    dbprintf("\tconsumer_id:\t%s\n", queue->consumer_id);
     dbprintf("\tkeys:\n");
     dbprintf("\t\t%s\n", queue->keys.queue);
     dbprintf("\t\t%s\n", queue->keys.bound);
@@ -505,5 +1255,9 @@ void pressure_print(pressureQueue *queue) {
     dbprintf("\t\t%s\n", queue->keys.stats_consumed_bytes);
     dbprintf("\t\t%s\n", queue->keys.not_full);
     dbprintf("\t\t%s\n", queue->keys.closed);
+    dbprintf("\t\t%s\n", queue->keys.inflight_count);
+    dbprintf("\t\t%s\n", queue->keys.consumers);
+    dbprintf("\t\t%s\n", queue->keys.inflight);
+    dbprintf("\t\t%s\n", queue->keys.heartbeat);
     dbprintf("}\n");
 }
\ No newline at end of file
@@ -1,12 +1,15 @@
 #pragma once
 
 #include <stdbool.h>
+#include <time.h>
 
 struct redisContext;
 struct redisReply;
 
 static const int BOUND_NOT_SET = -1;
 static const int UNBOUNDED = 0;
+static const int DEFAULT_ACK_BATCH = 16;
+static const int DEFAULT_HEARTBEAT_SECONDS = 10;
 
 typedef enum pressureStatus {
     kPressureStatus_Success,
@@ -20,12 +23,25 @@ typedef struct pressureQueue {
     redisContext *context;
     char *name;
     char *client_uid;
+    char *consumer_id;
 
     bool exists;
     bool connected;
     bool closed;
     int bound;
 
+    //  Reliable consumption state. Messages returned by pressure_get_reliable
+    //  stay in this handle's in-flight list until ack_batch of them have been
+    //  processed (or pressure_ack is called). If this handle goes
+    //  heartbeat_seconds without calling into the library, its in-flight
+    //  messages are redelivered to other consumers.
+    int ack_batch;
+    int heartbeat_seconds;
+    int inflight;
+    int inflight_references;
+    char **inflight_payloads;
+    time_t recovered_at;
+
     struct keys {
         char *queue;
         char *bound;
@@ -43,6 +59,11 @@ typedef struct pressureQueue {
 
         char *not_full;
         char *closed;
+        char *inflight_count;
+
+        char *consumers;
+        char *inflight;
+        char *heartbeat;
     } keys;
 } pressureQueue;
 
@@ -52,6 +73,67 @@ pressureStatus pressure_create(pressureQueue* queue, int bound);
 pressureStatus pressure_get(pressureQueue* queue, char **buf, int *bufsize);
 pressureStatus pressure_put(pressureQueue* queue, char *buf, int bufsize);
 
+//  Puts one message onto every queue in a constant number of round trips.
+//  All queues must share a connection, and no queue may be listed twice
+//  (even through different handles); otherwise nothing is put and
+//  kPressureStatus_UnexpectedFailure is returned. Each queue's exists and
+//  closed flags are updated; the first queue that couldn't take the message
+//  determines the returned status.
+//
+//  The producer role on every queue is held until the message has been put
+//  onto all of them, including while waiting for room in a full bounded
+//  queue. One full queue therefore holds up producers to every other queue
+//  in the broadcast, and a process that consumes one of these queues must
+//  not broadcast to the others, or it can deadlock on its own input.
+pressureStatus pressure_put_broadcast(pressureQueue **queues, int count, char *buf, int bufsize);
+
+//  As above, but stores the payload once in Redis and pushes only a reference
+//  to it onto each queue. pressure_get resolves the reference transparently.
+pressureStatus pressure_put_broadcast_shared(pressureQueue **queues, int count, char *buf, int bufsize);
+
+//  Replaces the consumer id generated by pressure_connect with a stable
+//  one, so that a consumer restarted with the same id reclaims whatever its
+//  previous run left in flight. No two live handles may share an id. Fails
+//  with kPressureStatus_UnexpectedFailure if messages are in flight.
+pressureStatus pressure_set_consumer_id(pressureQueue* queue, const char *consumer_id);
+
+//  Like pressure_get, but atomically moves the message into this handle's
+//  in-flight list instead of removing it. Calling this again marks every
+//  message it previously returned as processed; acknowledgements are sent
+//  to Redis once ack_batch messages are processed. The first call, every
+//  call after heartbeat_seconds, and every poll while the queue is empty
+//  also redeliver the in-flight messages of consumers that have died.
+pressureStatus pressure_get_reliable(pressureQueue* queue, char **buf, int *bufsize);
+
+//  Marks every message returned by pressure_get_reliable as processed and
+//  acknowledges them immediately. Call this before disconnecting.
+pressureStatus pressure_ack(pressureQueue* queue);
+
+//  Puts the in-flight messages of dead consumers back at the front of the
+//  queue, in their original order. If this handle has nothing in flight,
+//  anything left in its own in-flight list is put back too. recovered may
+//  be NULL.
+pressureStatus pressure_recover(pressureQueue* queue, int *recovered);
+
+//  Called on a worker thread for each message. The returned result is
+//  passed to the completion callback. buf belongs to the library and is
+//  freed once the completion callback returns, so handlers must copy
+//  anything they keep.
+typedef void *(*pressureHandler)(char *buf, int bufsize, void *userdata);
+
+//  Called on the consuming thread for each result, in the order the
+//  messages were put onto the queue.
+typedef void (*pressureCompletion)(void *result, void *userdata);
+
+//  Consumes the queue until it's closed and empty, running handler on up to
+//  nthreads threads at once (0 for one per core). Messages count towards the
+//  queue's bound until they're acknowledged, which happens only as they
+//  complete in order. completion may be NULL. Returns
+//  kPressureStatus_UnexpectedFailure if any message had to be skipped
+//  because its shared payload no longer existed.
+pressureStatus pressure_consume(pressureQueue *queue, pressureHandler handler, int nthreads,
+                                pressureCompletion completion, void *userdata);
+
 bool pressure_exists(pressureQueue* queue);
 pressureStatus pressure_length(pressureQueue *queue, int *length);
 pressureStatus pressure_closed(pressureQueue *queue, bool *closed);
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <hiredis/hiredis.h>
+
+#include "pressure.h"
+#include "pressure_internal.h"
+
+//  Number of messages that may be in flight per worker thread.
+static const int kPressureTasksPerThread = 4;
+
+//  Pops up to ARGV[1] messages and counts them in the queue's in-progress
+//  total in the same step, so that producers never see room they don't have.
+static const char *kPressureFetchScript =
+    "local items = {} "
+    "for i = 1, tonumber(ARGV[1]) do "
+    "  local item = redis.call('RPOP', KEYS[1]) "
+    "  if not item then break end "
+    "  items[#items + 1] = item "
+    "end "
+    "if #items > 0 then "
+    "  redis.call('INCRBY', KEYS[2], #items) "
+    "end "
+    "return items";
+
+//  How long the fetcher waits for a completion before polling Redis again
+//  while some, but not all, of the workers are busy.
+static const long kPressurePollIntervalNanoseconds = 10 * 1000 * 1000;
+
+typedef struct pressureTask {
+    char *buf;
+    int bufsize;
+    void *result;
+    atomic_bool done;
+} pressureTask;
+
+//  A fixed-size double-ended queue of tasks. The owning worker takes the
+//  oldest task from the front; other workers steal the newest from the back.
+typedef struct pressureDeque {
+    pthread_mutex_t lock;
+    pressureTask **tasks;
+    int capacity;
+    int front;
+    int length;
+} pressureDeque;
+
+typedef struct pressurePool {
+    pressureHandler handler;
+    void *userdata;
+
+    int nthreads;
+    pthread_t *threads;
+    pressureDeque *deques;
+
+    atomic_int queued;
+    bool stopping;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t task_completed;
+} pressurePool;
+
+typedef struct pressureWorker {
+    pressurePool *pool;
+    int id;
+} pressureWorker;
+
+static void pressure_deque_push(pressureDeque *deque, pressureTask *task) {
+    pthread_mutex_lock(&deque->lock);
+    deque->tasks[(deque->front + deque->length) % deque->capacity] = task;
+    deque->length++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static pressureTask *pressure_deque_take(pressureDeque *deque, bool steal) {
+    pressureTask *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->length > 0) {
+        if (steal) {
+            task = deque->tasks[(deque->front + deque->length - 1) % deque->capacity];
+        } else {
+            task = deque->tasks[deque->front];
+            deque->front = (deque->front + 1) % deque->capacity;
+        }
+        deque->length--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static pressureTask *pressure_pool_take(pressurePool *pool, int id) {
+    pressureTask *task = pressure_deque_take(&pool->deques[id], false);
+    for (int i = 1; task == NULL && i < pool->nthreads; i++) {
+        task = pressure_deque_take(&pool->deques[(id + i) % pool->nthreads], true);
+    }
+    if (task != NULL) {
+        atomic_fetch_sub(&pool->queued, 1);
+    }
+    return task;
+}
+
+static void *pressure_worker_main(void *arg) {
+    pressureWorker *worker = arg;
+    pressurePool *pool = worker->pool;
+
+    for (;;) {
+        pressureTask *task = pressure_pool_take(pool, worker->id);
+        if (task != NULL) {
+            task->result = pool->handler(task->buf, task->bufsize, pool->userdata);
+
+            pthread_mutex_lock(&pool->lock);
+            atomic_store(&task->done, true);
+            pthread_cond_signal(&pool->task_completed);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (atomic_load(&pool->queued) == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->work_available, &pool->lock);
+        }
+        bool stop = pool->stopping && atomic_load(&pool->queued) == 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void pressure_pool_submit(pressurePool *pool, pressureTask *task, int id) {
+    //  Count the task before it becomes visible, so that a worker taking it
+    //  straight away can't drive the count below zero.
+    atomic_fetch_add(&pool->queued, 1);
+    pressure_deque_push(&pool->deques[id % pool->nthreads], task);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+//  Blocks until the given task is done, or until the timeout (if any) expires.
+static void pressure_pool_wait(pressurePool *pool, pressureTask *task, bool timeout) {
+    struct timespec deadline;
+    if (timeout) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += kPressurePollIntervalNanoseconds;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (!atomic_load(&task->done)) {
+        if (!timeout) {
+            pthread_cond_wait(&pool->task_completed, &pool->lock);
+        } else if (pthread_cond_timedwait(&pool->task_completed, &pool->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+pressureStatus pressure_consume(pressureQueue *queue, pressureHandler handler, int nthreads,
+                                pressureCompletion completion, void *userdata) {
+    //  Check if the queue exists.
+    {
+        redisReply *reply = redisCommand(queue->context, "EXISTS %s", queue->keys.bound);
+        queue->exists = reply->integer;
+        freeReplyObject(reply);
+    }
+
+    if (!queue->exists) {
+        return kPressureStatus_QueueDoesNotExistError;
+    }
+
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads <= 0) {
+            nthreads = 1;
+        }
+    }
+
+    //  Messages being processed still count towards the queue's bound (through
+    //  its inflight_count key), so never take more than the bound at once.
+    int window = nthreads * kPressureTasksPerThread;
+    if (queue->bound > 0) {
+        window = min(window, queue->bound);
+    }
+
+    {
+        dbprintf("Waiting on a consumer_free key...\n");
+        redisReply *reply = redisCommand(queue->context, "BRPOP %s 0", queue->keys.consumer_free);
+        freeReplyObject(reply);
+        dbprintf("Got a consumer_free key!\n");
+    }
+
+    {
+        //  This is the only consumer, so any in-progress count left over from
+        //  one that died is stale.
+        redisAppendCommand(queue->context, "SET %s %s", queue->keys.consumer, queue->client_uid);
+        redisAppendCommand(queue->context, "SET %s 0", queue->keys.inflight_count);
+        pressure_discard_replies(queue->context, 2);
+        dbprintf("Set consumer tag '%s' to '%s'.\n", queue->keys.consumer, queue->client_uid);
+    }
+
+    {
+        redisReply *reply = redisCommand(queue->context, "EXISTS %s", queue->keys.closed);
+        queue->closed = reply->integer;
+        freeReplyObject(reply);
+    }
+
+    pressurePool pool = {
+        .handler = handler,
+        .userdata = userdata,
+        .nthreads = nthreads,
+        .threads = malloc(nthreads * sizeof(pthread_t)),
+        .deques = malloc(nthreads * sizeof(pressureDeque)),
+        .stopping = false,
+    };
+    atomic_init(&pool.queued, 0);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_available, NULL);
+    pthread_cond_init(&pool.task_completed, NULL);
+
+    pressureWorker *workers = malloc(nthreads * sizeof(pressureWorker));
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        pool.deques[i].tasks = malloc(window * sizeof(pressureTask *));
+        pool.deques[i].capacity = window;
+        pool.deques[i].front = 0;
+        pool.deques[i].length = 0;
+
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        pthread_create(&pool.threads[i], NULL, pressure_worker_main, &workers[i]);
+    }
+
+    //  Messages are kept in a ring in the order they were popped, and are
+    //  acknowledged strictly from its head. head and tail count messages.
+    pressureTask *ring = calloc(window, sizeof(pressureTask));
+    unsigned long head = 0;
+    unsigned long tail = 0;
+
+    pressureStatus status = kPressureStatus_Success;
+    bool exhausted = false;
+
+    while (!exhausted || head < tail) {
+        //  Acknowledge the completed prefix of the ring, in order.
+        int acked_messages = 0;
+        long long acked_bytes = 0;
+        while (head < tail && atomic_load(&ring[head % window].done)) {
+            pressureTask *task = &ring[head % window];
+            if (completion != NULL) {
+                completion(task->result, userdata);
+            }
+            acked_messages++;
+            acked_bytes += task->bufsize;
+            free(task->buf);
+            head++;
+        }
+
+        if (acked_messages > 0) {
+            dbprintf("Acknowledged %d messages.\n", acked_messages);
+            redisAppendCommand(queue->context, "DECRBY %s %d", queue->keys.inflight_count, acked_messages);
+            redisAppendCommand(queue->context, "LPUSH %s 0", queue->keys.not_full);
+            redisAppendCommand(queue->context, "LTRIM %s 0 0", queue->keys.not_full);
+            redisAppendCommand(queue->context, "INCRBY %s %d", queue->keys.stats_consumed_messages, acked_messages);
+            redisAppendCommand(queue->context, "INCRBY %s %lld", queue->keys.stats_consumed_bytes, acked_bytes);
+            pressure_discard_replies(queue->context, 5);
+        }
+
+        int free_slots = window - (int) (tail - head);
+        if (exhausted || free_slots == 0) {
+            if (head < tail) {
+                pressure_pool_wait(&pool, &ring[head % window], false);
+            }
+            continue;
+        }
+
+        //  Fetch as many messages as there is room for. Block only if nothing
+        //  is in flight; otherwise poll, so that completions aren't delayed.
+        redisReply **elements = malloc(free_slots * sizeof(redisReply *));
+        redisReply *blocked = NULL;
+        redisReply *batch = NULL;
+        int fetched = 0;
+
+        if (head == tail && !queue->closed) {
+            dbprintf("Waiting on data...\n");
+            redisReply *reply = redisCommand(queue->context, "BRPOP %s %s 0", queue->keys.queue, queue->keys.closed);
+            if (!strcmp(queue->keys.closed, reply->element[0]->str)) {
+                queue->closed = true;
+                freeReplyObject(reply);
+            } else {
+                blocked = reply;
+                elements[fetched++] = reply->element[1];
+                free_slots--;
+
+                //  BRPOP can't be scripted, so count this one as soon as possible.
+                freeReplyObject(redisCommand(queue->context, "INCRBY %s 1", queue->keys.inflight_count));
+            }
+        }
+
+        bool polled = false;
+        if (fetched == 0 || free_slots > 0) {
+            redisAppendCommand(queue->context, "EVAL %s 2 %s %s %d", kPressureFetchScript,
+                               queue->keys.queue, queue->keys.inflight_count, free_slots);
+            redisAppendCommand(queue->context, "EXISTS %s", queue->keys.closed);
+            if (redisGetReply(queue->context, (void **) &batch) == REDIS_OK
+                && batch->type == REDIS_REPLY_ARRAY) {
+                for (size_t i = 0; i < batch->elements; i++) {
+                    elements[fetched++] = batch->element[i];
+                }
+            }
+            queue->closed = pressure_integer_reply(queue->context) || queue->closed;
+            polled = true;
+        }
+
+        for (int i = 0; i < fetched; i++) {
+            pressureTask *task = &ring[tail % window];
+            task->buf = NULL;
+            task->result = NULL;
+            atomic_store(&task->done, false);
+
+            if (pressure_read_element(queue, elements[i], &task->buf, &task->bufsize, true) < 0) {
+                //  The shared payload behind this message is gone, so it can't
+                //  be delivered; skip it, but keep the rest of the batch. It
+                //  still made room in the queue, so wake a waiting producer.
+                status = kPressureStatus_UnexpectedFailure;
+                redisAppendCommand(queue->context, "DECRBY %s 1", queue->keys.inflight_count);
+                redisAppendCommand(queue->context, "LPUSH %s 0", queue->keys.not_full);
+                redisAppendCommand(queue->context, "LTRIM %s 0 0", queue->keys.not_full);
+                pressure_discard_replies(queue->context, 3);
+                continue;
+            }
+            pressure_pool_submit(&pool, task, (int) (tail % nthreads));
+            tail++;
+        }
+        dbprintf("Fetched %d messages, %d in flight.\n", fetched, (int) (tail - head));
+
+        if (blocked != NULL) {
+            freeReplyObject(blocked);
+        }
+        if (batch != NULL) {
+            freeReplyObject(batch);
+        }
+        free(elements);
+
+        if (polled && fetched == 0) {
+            if (queue->closed) {
+                exhausted = true;
+            } else if (head < tail) {
+                pressure_pool_wait(&pool, &ring[head % window], true);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.work_available);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(pool.threads[i], NULL);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    pthread_cond_destroy(&pool.task_completed);
+    pthread_cond_destroy(&pool.work_available);
+    pthread_mutex_destroy(&pool.lock);
+
+    free(ring);
+    free(workers);
+    free(pool.deques);
+    free(pool.threads);
+
+    freeReplyObject(redisCommand(
+        queue->context, "LPUSH %s 0", queue->keys.consumer_free
+    ));
+    return status;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+//  Helpers shared between the files that make up libpressure.
+//  Not part of the public API; include after hiredis.h and pressure.h.
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+#ifdef DEBUG
+    #define dbprintf(fmt, ...) printf(fmt, ##__VA_ARGS__)
+#else
+    #define dbprintf(fmt, ...)
+#endif
+
+//  Reads and frees the next count pipelined replies.
+void pressure_discard_replies(redisContext *context, int count);
+
+//  Reads the next pipelined reply as an integer, or 0 on failure.
+long long pressure_integer_reply(redisContext *context);
+
+//  Reads the next pipelined reply as a number stored in a string (as GET
+//  returns it), or 0 if the key didn't exist.
+long long pressure_count_reply(redisContext *context);
+
+//  Copies a popped element into the caller's buffer, following it to its
+//  shared payload if it's a reference. If release is set, the reference is
+//  released; otherwise it's counted in queue->inflight_references, to be
+//  released when acknowledged. Returns the length of the message, or -1 if
+//  the referenced payload no longer exists.
+int pressure_read_element(pressureQueue *queue, redisReply *element, char **buf, int *bufsize, bool release);
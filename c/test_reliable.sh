@@ -0,0 +1,46 @@
+#!/bin/bash
+#
+#   Kills a reliable consumer partway through a batch and checks that the
+#   next consumer delivers every message exactly once. Needs a local Redis
+#   and `make clients`.
+
+status=0
+out=$(mktemp -d)
+
+check() {
+    if diff -q "$2" <(seq 1 100) > /dev/null; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1"
+        status=1
+    fi
+}
+
+cleanup() {
+    redis-cli --scan --pattern "__pressure__:$1*" | xargs -r redis-cli del > /dev/null
+}
+
+#   The same consumer id restarts and reclaims its own in-flight messages,
+#   so they arrive in order.
+queue=test_reliable_restart_$$
+seq 1 100 | ./put $queue &
+./get -r worker -k 40 $queue > $out/first
+./get -r worker $queue > $out/second
+wait
+cat $out/first $out/second > $out/all
+check "restarted consumer gets every message once, in order" $out/all
+cleanup $queue
+
+#   A different consumer only gets the dead one's messages once its
+#   heartbeat expires, so they arrive late.
+queue=test_reliable_takeover_$$
+seq 1 100 | ./put $queue &
+./get -r worker_a -k 40 $queue > $out/first
+./get -r worker_b $queue > $out/second
+wait
+cat $out/first $out/second | sort -n > $out/all
+check "second consumer gets every message once" $out/all
+cleanup $queue
+
+rm -r $out
+exit $status